@@ -2,7 +2,7 @@
 #include <iterator>
 #include <fstream>
 #include <iostream>
-#include "rpc/client.h"
+#include "gpu_worker_client.h"
 
 std::vector<uint8_t> read_file(const char* filename) {
     std::ifstream file(filename, std::ios::in | std::ios::binary);
@@ -28,20 +28,47 @@ std::vector<uint8_t> read_file(const char* filename) {
     return vec;
 }
 
+static void
+print_result(const char* what, const GpuWorkerMatmulResult& result) {
+    if (!result.ok) {
+        std::cout << what << " failed!" << std::endl;
+        return;
+    }
+    std::cout << what << " done, c[0] = " << result.c[0]
+              << ", input checksum " << result.input_checksum
+              << ", output checksum " << result.output_checksum << std::endl;
+}
+
 int main() {
     std::cout << "Hello from the RPC client!" << std::endl;
 
-    // Creating a client that connects to the localhost on port 8080
-    rpc::client client("127.0.0.1", 5826);
+    // Creating a client that connects to the localhost on port 5826
+    GpuWorkerClient client({ { "127.0.0.1", 5826 } });
 
     std::vector<uint8_t> eapp_bytes = read_file("./extracted/gpu-worker-eapp");
     std::vector<uint8_t> runtime_bytes = read_file("./extracted/eyrie-rt");
     std::vector<uint8_t> loader_bytes = read_file("./extracted/loader.bin");
 
-    // std::vector<uint8_t> vec = {42, 0x41, 13, 37, 7, 7, 7, 7, 7};
-    client.call("eapp", eapp_bytes, runtime_bytes, loader_bytes);
+    client.load_eapp(eapp_bytes, runtime_bytes, loader_bytes);
+
+    //client.async_call(0, "helloworld").wait();
+
+    // Large enough for the host to split it across its enclaves
+    const uint64_t rows = 256, inner = 256, cols = 256;
+    std::vector<float> a(rows * inner), b(inner * cols);
+    for (size_t i = 0; i < a.size(); i++) a[i] = (float)(i % 7);
+    for (size_t i = 0; i < b.size(); i++) b[i] = (float)(i % 5);
+
+    // Keep several jobs in flight at once
+    std::vector<std::future<GpuWorkerMatmulResult>> jobs;
+    for (int i = 0; i < 4; i++) {
+        jobs.push_back(client.matmul_async(rows, inner, cols, a, b));
+    }
+    for (auto& job : jobs) {
+        print_result("Matmul", job.get());
+    }
 
-    //client.call("helloworld");
-    client.call("matmul");
+    // Same job, streamed in and out in chunks
+    print_result("Streamed matmul", client.matmul_streamed(rows, inner, cols, a, b));
     return 0;
 }
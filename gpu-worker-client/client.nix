@@ -12,7 +12,9 @@ in
     nativeBuildInputs = [ cmake pkg-config rpclib ];
 
     installPhase = ''
-      mkdir -p $out/bin
+      mkdir -p $out/bin $out/lib $out/include
       cp gpu-worker-client $out/bin/
+      cp libgpu-worker-client.a $out/lib/
+      cp $src/gpu_worker_client.h $out/include/
     '';
   }
@@ -0,0 +1,320 @@
+#include "gpu_worker_client.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <tuple>
+
+#include "rpc/rpc_error.h"
+
+// Turns the host's { reason, retry after ms } job rejections into
+// GpuWorkerRejected, other errors are passed on as they are.
+static const RPCLIB_MSGPACK::object_handle&
+get_or_throw_rejected(const GpuWorkerClient::Call& f) {
+  try {
+    return f.get();
+  } catch (rpc::rpc_error& e) {
+    std::tuple<std::string, uint64_t> rejection;
+    bool rejected = true;
+    try {
+      rejection = e.get_error().as<std::tuple<std::string, uint64_t>>();
+    } catch (...) {
+      rejected = false;
+    }
+    if (rejected) {
+      throw GpuWorkerRejected(std::get<0>(rejection), std::get<1>(rejection));
+    }
+    throw;
+  }
+}
+
+bool
+GpuWorkerClient::Call::wait_until_deadline() const {
+  if (result_.wait_until(deadline_) == std::future_status::ready) {
+    return true;
+  }
+  client_->replace_connection(host_, connection_);
+  return false;
+}
+
+const RPCLIB_MSGPACK::object_handle&
+GpuWorkerClient::Call::get() const {
+  if (!wait_until_deadline()) {
+    throw GpuWorkerTimeout();
+  }
+  return result_.get();
+}
+
+void
+GpuWorkerClient::Call::wait() const {
+  try {
+    wait_until_deadline();
+  } catch (...) {
+  }
+}
+
+GpuWorkerClient::GpuWorkerClient(
+    const std::vector<GpuWorkerEndpoint>& hosts, size_t connections_per_host,
+    size_t max_in_flight, uint64_t timeout_ms)
+    : next_host_(0),
+      max_in_flight_(std::max(max_in_flight, (size_t)1)),
+      timeout_(timeout_ms),
+      reserved_(0) {
+  if (hosts.empty() || connections_per_host == 0) {
+    throw std::invalid_argument("GpuWorkerClient: no connections");
+  }
+
+  for (const GpuWorkerEndpoint& endpoint : hosts) {
+    std::unique_ptr<HostPool> host(new HostPool());
+    host->endpoint = endpoint;
+    host->next = 0;
+    for (size_t i = 0; i < connections_per_host; i++) {
+      host->connections.push_back(std::make_shared<rpc::client>(
+          endpoint.host, endpoint.port));
+    }
+    pool_.push_back(std::move(host));
+  }
+}
+
+std::shared_ptr<rpc::client>
+GpuWorkerClient::next_connection(size_t host) {
+  HostPool& p = *pool_.at(host);
+  std::lock_guard<std::mutex> host_lg(p.lock);
+  std::shared_ptr<rpc::client>& c =
+      p.connections[p.next++ % p.connections.size()];
+
+  // rpclib doesn't reconnect by itself
+  rpc::client::connection_state state = c->get_connection_state();
+  if (state == rpc::client::connection_state::disconnected ||
+      state == rpc::client::connection_state::reset) {
+    c = std::make_shared<rpc::client>(p.endpoint.host, p.endpoint.port);
+  }
+  return c;
+}
+
+void
+GpuWorkerClient::replace_connection(
+    size_t host, const std::shared_ptr<rpc::client>& connection) {
+  HostPool& p = *pool_.at(host);
+  std::lock_guard<std::mutex> host_lg(p.lock);
+  for (std::shared_ptr<rpc::client>& c : p.connections) {
+    // Calls still pending on the old connection keep it alive until they
+    // time out as well
+    if (c == connection) {
+      c = std::make_shared<rpc::client>(p.endpoint.host, p.endpoint.port);
+    }
+  }
+}
+
+size_t
+GpuWorkerClient::next_host() {
+  return next_host_++ % pool_.size();
+}
+
+void
+GpuWorkerClient::acquire_window() {
+  std::unique_lock<std::mutex> in_flight_lg(in_flight_lock_);
+  for (;;) {
+    // Forget about everything that has completed or timed out already
+    Clock::time_point now = Clock::now();
+    for (auto it = in_flight_.begin(); it != in_flight_.end();) {
+      if (it->result_.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+        it = in_flight_.erase(it);
+      } else if (now >= it->deadline_) {
+        replace_connection(it->host_, it->connection_);
+        it = in_flight_.erase(it);
+      } else {
+        it++;
+      }
+    }
+
+    if (in_flight_.size() + reserved_ < max_in_flight_) {
+      reserved_++;
+      return;
+    }
+
+    // Futures can't notify on completion, so poll for any call having
+    // completed; woken early when a reservation is given up.
+    in_flight_cv_.wait_for(in_flight_lg, std::chrono::milliseconds(1));
+  }
+}
+
+void
+GpuWorkerClient::release_window(const Call* call) {
+  {
+    std::lock_guard<std::mutex> in_flight_lg(in_flight_lock_);
+    reserved_--;
+    if (call) {
+      in_flight_.push_back(*call);
+    }
+  }
+  if (!call) {
+    in_flight_cv_.notify_one();
+  }
+}
+
+bool
+GpuWorkerClient::load_eapp(
+    const std::vector<uint8_t>& eapp, const std::vector<uint8_t>& runtime,
+    const std::vector<uint8_t>& loader) {
+  std::vector<Call> loads;
+  for (size_t host = 0; host < pool_.size(); host++) {
+    loads.push_back(async_call(host, "eapp", eapp, runtime, loader));
+  }
+
+  bool ok = true;
+  for (auto& f : loads) {
+    ok = f.get().as<bool>() && ok;
+  }
+  return ok;
+}
+
+std::future<GpuWorkerMatmulResult>
+GpuWorkerClient::matmul_async(
+    uint64_t rows, uint64_t inner, uint64_t cols, const std::vector<float>& a,
+    const std::vector<float>& b, int priority, uint64_t deadline_ms) {
+  Call f = async_call(
+      next_host(), "matmul", rows, inner, cols, a, b, priority, deadline_ms);
+
+  // Deferred, so no thread is spent on unpacking the response
+  return std::async(std::launch::deferred, [f]() -> GpuWorkerMatmulResult {
+    auto t = get_or_throw_rejected(f)
+                 .as<std::tuple<bool, std::vector<float>, uint64_t, uint64_t>>();
+    GpuWorkerMatmulResult result;
+    result.ok = std::get<0>(t);
+    result.c = std::move(std::get<1>(t));
+    result.input_checksum = std::get<2>(t);
+    result.output_checksum = std::get<3>(t);
+    return result;
+  });
+}
+
+GpuWorkerRemoteMatrix
+GpuWorkerClient::upload(size_t host, const std::vector<float>& m) {
+  if (m.empty()) {
+    throw std::invalid_argument("GpuWorkerClient: empty matrix");
+  }
+
+  GpuWorkerRemoteMatrix remote;
+  remote.host = host;
+  remote.count = m.size();
+  remote.id =
+      async_call(host, "matrix_create", remote.count).get().as<uint64_t>();
+  if (remote.id == 0) {
+    throw std::runtime_error("GpuWorkerClient: host matrix store is full");
+  }
+
+  std::vector<Call> writes;
+  bool ok = true;
+  try {
+    for (uint64_t offset = 0; offset < m.size();
+         offset += GPU_WORKER_CHUNK_ELEMS) {
+      auto begin = m.begin() + offset;
+      std::vector<float> chunk(
+          begin, begin + std::min(
+                             (uint64_t)GPU_WORKER_CHUNK_ELEMS,
+                             (uint64_t)m.size() - offset));
+      writes.push_back(
+          async_call(host, "matrix_write", remote.id, offset, chunk));
+    }
+
+    for (auto& f : writes) {
+      ok = f.get().as<bool>() && ok;
+    }
+  } catch (...) {
+    // Wait for the writes already issued (at most until they time out),
+    // such that none of them lands after the release, then don't leave
+    // the matrix behind on the host. A write that timed out and lands
+    // anyway is refused by the host, as the id is gone by then. The
+    // original error is the one worth reporting.
+    for (auto& f : writes) {
+      f.wait();
+    }
+    try {
+      release(remote);
+    } catch (...) {
+    }
+    throw;
+  }
+  if (!ok) {
+    release(remote);
+    throw std::runtime_error("GpuWorkerClient: matrix upload failed");
+  }
+  return remote;
+}
+
+std::vector<float>
+GpuWorkerClient::download(const GpuWorkerRemoteMatrix& m) {
+  std::vector<Call> reads;
+  for (uint64_t offset = 0; offset < m.count;
+       offset += GPU_WORKER_CHUNK_ELEMS) {
+    uint64_t count =
+        std::min((uint64_t)GPU_WORKER_CHUNK_ELEMS, m.count - offset);
+    reads.push_back(async_call(m.host, "matrix_read", m.id, offset, count));
+  }
+
+  std::vector<float> result;
+  result.reserve(m.count);
+  for (auto& f : reads) {
+    std::vector<float> chunk = f.get().as<std::vector<float>>();
+    result.insert(result.end(), chunk.begin(), chunk.end());
+  }
+  if (result.size() != m.count) {
+    throw std::runtime_error("GpuWorkerClient: matrix download failed");
+  }
+  return result;
+}
+
+void
+GpuWorkerClient::release(const GpuWorkerRemoteMatrix& m) {
+  async_call(m.host, "matrix_release", m.id).wait();
+}
+
+GpuWorkerMatmulResult
+GpuWorkerClient::matmul_streamed(
+    uint64_t rows, uint64_t inner, uint64_t cols, const std::vector<float>& a,
+    const std::vector<float>& b, int priority, uint64_t deadline_ms) {
+  size_t host = next_host();
+  GpuWorkerRemoteMatrix ra = upload(host, a);
+  GpuWorkerRemoteMatrix rb;
+  try {
+    rb = upload(host, b);
+  } catch (...) {
+    release(ra);
+    throw;
+  }
+
+  std::tuple<bool, uint64_t, uint64_t, uint64_t> t;
+  try {
+    t = get_or_throw_rejected(
+            async_call(
+                host, "matmul_stored", rows, inner, cols, ra.id, rb.id,
+                priority, deadline_ms))
+            .as<std::tuple<bool, uint64_t, uint64_t, uint64_t>>();
+  } catch (...) {
+    release(ra);
+    release(rb);
+    throw;
+  }
+  release(ra);
+  release(rb);
+
+  GpuWorkerMatmulResult result;
+  result.ok = std::get<0>(t);
+  result.input_checksum = std::get<2>(t);
+  result.output_checksum = std::get<3>(t);
+  if (result.ok) {
+    GpuWorkerRemoteMatrix rc;
+    rc.host = host;
+    rc.id = std::get<1>(t);
+    rc.count = rows * cols;
+    try {
+      result.c = download(rc);
+    } catch (...) {
+      release(rc);
+      throw;
+    }
+    release(rc);
+  }
+  return result;
+}
@@ -0,0 +1,182 @@
+#ifndef _GPU_WORKER_CLIENT_H_
+#define _GPU_WORKER_CLIENT_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rpc/client.h"
+
+// Matrices are streamed to and from the host in chunks of this many
+// elements when using the *_streamed calls.
+#define GPU_WORKER_CHUNK_ELEMS (64 * 1024)
+
+struct GpuWorkerEndpoint {
+  std::string host;
+  uint16_t port;
+};
+
+struct GpuWorkerMatmulResult {
+  bool ok;
+  std::vector<float> c;
+  uint64_t input_checksum;
+  uint64_t output_checksum;
+};
+
+/* Thrown when a host turned a job away rather than running it. `reason`
+ * is "overloaded" (try again after `retry_after_ms`) or
+ * "deadline_missed". */
+class GpuWorkerRejected : public std::runtime_error {
+ public:
+  GpuWorkerRejected(const std::string& reason, uint64_t retry_after_ms)
+      : std::runtime_error("GpuWorkerClient: job rejected: " + reason),
+        reason(reason),
+        retry_after_ms(retry_after_ms) {}
+
+  std::string const reason;
+  uint64_t const retry_after_ms;
+};
+
+/* Thrown when a call hasn't completed within the client's timeout. */
+class GpuWorkerTimeout : public std::runtime_error {
+ public:
+  GpuWorkerTimeout() : std::runtime_error("GpuWorkerClient: call timed out") {}
+};
+
+// A matrix staged on one particular gpu-worker-runner host
+struct GpuWorkerRemoteMatrix {
+  size_t host;
+  uint64_t id;
+  uint64_t count;
+};
+
+/* Client for one or more gpu-worker-runner hosts. Keeps a pool of
+ * connections per host and pipelines requests over them, with at most
+ * `max_in_flight` calls outstanding at once; issuing another call blocks
+ * until any of them has completed. Safe to use from multiple threads.
+ *
+ * Calls not completed within `timeout_ms` of being issued, including the
+ * time spent queued on the host, fail with GpuWorkerTimeout and give up
+ * their place in the window. A dropped connection never completes its
+ * calls, so the connection a call timed out on is replaced, as are ones
+ * found disconnected. Errors reported by the host surface as
+ * rpc::rpc_error, protocol errors as std::runtime_error. */
+class GpuWorkerClient {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  /* A call issued to a host. Must not outlive the client. */
+  class Call {
+   public:
+    /* Blocks until the reply arrives, throws GpuWorkerTimeout if it
+     * doesn't in time and the host's error if the call failed. */
+    const RPCLIB_MSGPACK::object_handle& get() const;
+    /* Like get(), without throwing. */
+    void wait() const;
+
+   private:
+    friend class GpuWorkerClient;
+    // Waits for the reply, returns false if it timed out
+    bool wait_until_deadline() const;
+
+    GpuWorkerClient* client_;
+    size_t host_;
+    std::shared_ptr<rpc::client> connection_;
+    std::shared_future<RPCLIB_MSGPACK::object_handle> result_;
+    Clock::time_point deadline_;
+  };
+
+  GpuWorkerClient(
+      const std::vector<GpuWorkerEndpoint>& hosts,
+      size_t connections_per_host = 4, size_t max_in_flight = 32,
+      uint64_t timeout_ms = 60 * 1000);
+  GpuWorkerClient(const GpuWorkerClient&) = delete;
+  GpuWorkerClient& operator=(const GpuWorkerClient&) = delete;
+
+  size_t hosts() const { return pool_.size(); }
+
+  /* Issues `func` on the next connection to `host`. */
+  template <typename... Args>
+  Call async_call(size_t host, const std::string& func, const Args&... args) {
+    acquire_window();
+    Call call;
+    try {
+      call.client_ = this;
+      call.host_ = host;
+      call.connection_ = next_connection(host);
+      call.deadline_ = Clock::now() + timeout_;
+      call.result_ = call.connection_->async_call(func, args...).share();
+    } catch (...) {
+      release_window(nullptr);
+      throw;
+    }
+    release_window(&call);
+    return call;
+  }
+
+  /* Loads the enclave binaries on every host. */
+  bool load_eapp(
+      const std::vector<uint8_t>& eapp, const std::vector<uint8_t>& runtime,
+      const std::vector<uint8_t>& loader);
+
+  /* Single-message matmul, spread round-robin across hosts. Higher
+   * priority jobs are run first by the host, jobs not started within
+   * `deadline_ms` (0 for none) are dropped with GpuWorkerRejected. */
+  std::future<GpuWorkerMatmulResult> matmul_async(
+      uint64_t rows, uint64_t inner, uint64_t cols,
+      const std::vector<float>& a, const std::vector<float>& b,
+      int priority = 0, uint64_t deadline_ms = 0);
+
+  /* Chunked staging of matrices on a host, for jobs too large to send in
+   * one message. Hosts drop staged matrices not used for a minute. */
+  GpuWorkerRemoteMatrix upload(size_t host, const std::vector<float>& m);
+  std::vector<float> download(const GpuWorkerRemoteMatrix& m);
+  void release(const GpuWorkerRemoteMatrix& m);
+
+  /* Uploads a and b in chunks, multiplies them on the host and downloads
+   * the result in chunks. Staged matrices are released afterwards. */
+  GpuWorkerMatmulResult matmul_streamed(
+      uint64_t rows, uint64_t inner, uint64_t cols,
+      const std::vector<float>& a, const std::vector<float>& b,
+      int priority = 0, uint64_t deadline_ms = 0);
+
+ private:
+  std::shared_ptr<rpc::client> next_connection(size_t host);
+  // Swaps `connection` for a new one, unless that happened already
+  void replace_connection(
+      size_t host, const std::shared_ptr<rpc::client>& connection);
+  size_t next_host();
+  // Blocks until there is room for another call, and reserves it
+  void acquire_window();
+  // Turns the reservation into the in-flight call `call`, or gives it up
+  // if the call couldn't be issued
+  void release_window(const Call* call);
+
+  struct HostPool {
+    GpuWorkerEndpoint endpoint;
+    std::mutex lock;
+    std::vector<std::shared_ptr<rpc::client>> connections;
+    size_t next;
+  };
+
+  std::vector<std::unique_ptr<HostPool>> pool_;
+  std::atomic<size_t> next_host_;
+
+  size_t const max_in_flight_;
+  std::chrono::milliseconds const timeout_;
+  std::mutex in_flight_lock_;
+  std::condition_variable in_flight_cv_;
+  std::deque<Call> in_flight_;
+  // Calls being issued, counted against the window already
+  size_t reserved_;
+};
+
+#endif /* _GPU_WORKER_CLIENT_H_ */
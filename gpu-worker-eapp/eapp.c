@@ -30,6 +30,11 @@
 #define OCALLCMD_MATMUL_GET_MATRIX_DIMS 100
 #define OCALLCMD_MATMUL_GET_MATRIX_IN 101
 #define OCALLCMD_MATMUL_COPY_REPORT 102
+#define OCALLCMD_MATMUL_PUT_MATRIX_OUT 103
+
+// Largest output chunk handed to the host per ocall, needs to fit into
+// the shared buffer next to the edge call header.
+#define MATMUL_OUT_CHUNK (256 * 1024)
 
 // Static allocation, to avoid OOM errors when logging.
 static char enclave_log_buf[2048];
@@ -97,52 +102,92 @@ void checksum(checksum_state_t *state, void *input, size_t size);
 size_t checksum_finalize(checksum_state_t *state);
 size_t matrix_mul(float *m1, float *m2, float *m3, size_t *d1, size_t *d2);
 
+// Fills `m` (len bytes) with chunks of the input matrices handed out by
+// the host. Returns non-zero if the host ran out of data early.
+static int
+matmul_copy_in(float *m, size_t len, checksum_state_t *cs) {
+  struct edge_data retdata;
+  size_t offset = 0;
+
+  while (offset < len) {
+    ocall(OCALLCMD_MATMUL_GET_MATRIX_IN, NULL, 0, &retdata, sizeof(struct edge_data));
+    if (retdata.size == 0) {
+      return 1;
+    }
+    size_t copy_len = (len - offset < retdata.size) ? len - offset : retdata.size;
+    copy_from_shared((uint8_t*) m + offset, retdata.offset, copy_len);
+    checksum(cs, (uint8_t*) m + offset, copy_len);
+    offset += copy_len;
+  }
+
+  return 0;
+}
+
+// Computes one (possibly partial) matmul job: the host sends the row band
+// of the left-hand matrix this enclave is responsible for, along with the
+// full right-hand matrix, and receives the matching band of the output.
 void run_matmul() {
   checksum_state_t input_cs, output_cs;
   checksum_init(&input_cs);
   checksum_init(&output_cs);
 
+  // { status, input checksum, output checksum }
+  size_t report[3] = { 1, 0, 0 };
+  float *m1 = NULL, *m2 = NULL, *m3 = NULL;
+
   struct edge_data retdata;
   ocall(OCALLCMD_MATMUL_GET_MATRIX_DIMS, NULL, 0, &retdata, sizeof(struct edge_data));
 
-  size_t matrix_dims[2];
-  if (retdata.size != 2 * sizeof(size_t)) {
+  // { rows, inner, cols }
+  size_t matrix_dims[3];
+  if (retdata.size != 3 * sizeof(size_t)) {
     enclave_log("Invalid matrix dimensions buffer size!\r\n");
-    EAPP_RETURN(1);
+    goto report;
   }
   copy_from_shared((uint8_t*) matrix_dims, retdata.offset, retdata.size);
   checksum(&input_cs, matrix_dims, retdata.size);
-  enclave_log("Received matrix dimensions %lu x %lu, allocating...\r\n",
-              matrix_dims[0], matrix_dims[1]);
-  size_t matrix_size = matrix_dims[0] * matrix_dims[1];
-  //float* matrix = malloc(matrix_size);
- 
-  float *m1 =  malloc(sizeof(float) * matrix_size);
-  float *m2 =  malloc(sizeof(float) * matrix_size);
-  float *m3 =  malloc(sizeof(float) * matrix_size);
-  enclave_log("Allocated matrix buffer.\r\n");
-
-  // Chunked copy:
-  for (size_t i = 0; i < 2; i++) {
-    size_t offset = 0;
-    float* m = i == 0 ? m1 : i == 1 ? m2 : m3;
-    while (offset < matrix_size) {
-      enclave_log("Copying at offset %lu\r\n", offset);
-      ocall(OCALLCMD_MATMUL_GET_MATRIX_IN, NULL, 0, &retdata, sizeof(struct edge_data));
-      size_t copy_len = (matrix_size - offset < retdata.size) ? matrix_size - offset : retdata.size;
-      copy_from_shared((uint8_t*) &m[offset], retdata.offset, copy_len);
-      checksum(&input_cs, m, copy_len);
-      offset += copy_len;
-    }
-    enclave_log("Matrix... DONE %lu\r\n", i);
+  enclave_log("Received matrix dimensions %lu x %lu x %lu, allocating...\r\n",
+              matrix_dims[0], matrix_dims[1], matrix_dims[2]);
+
+  size_t dims1[2] = { matrix_dims[0], matrix_dims[1] };
+  size_t dims2[2] = { matrix_dims[1], matrix_dims[2] };
+  size_t m1_len = sizeof(float) * dims1[0] * dims1[1];
+  size_t m2_len = sizeof(float) * dims2[0] * dims2[1];
+  size_t m3_len = sizeof(float) * dims1[0] * dims2[1];
+
+  m1 = malloc(m1_len);
+  m2 = malloc(m2_len);
+  m3 = malloc(m3_len);
+  if (m1 == NULL || m2 == NULL || m3 == NULL) {
+    enclave_log("Failed to allocate matrix buffers!\r\n");
+    goto report;
+  }
+
+  if (matmul_copy_in(m1, m1_len, &input_cs) || matmul_copy_in(m2, m2_len, &input_cs)) {
+    enclave_log("Host ran out of matrix input!\r\n");
+    goto report;
   }
 
-  size_t ret = matrix_mul(m1, m2, m3, matrix_dims, matrix_dims);
-  enclave_log("Matrix MUL DONE %f\r\n", m3[0]);
+  if (matrix_mul(m1, m2, m3, dims1, dims2)) {
+    goto report;
+  }
+  checksum(&output_cs, m3, m3_len);
+
+  // Chunked copy out:
+  for (size_t offset = 0; offset < m3_len; offset += MATMUL_OUT_CHUNK) {
+    size_t copy_len = (m3_len - offset < MATMUL_OUT_CHUNK) ? m3_len - offset : MATMUL_OUT_CHUNK;
+    ocall(OCALLCMD_MATMUL_PUT_MATRIX_OUT, (uint8_t*) m3 + offset, copy_len, NULL, 0);
+  }
 
-  size_t sum = checksum_finalize(&input_cs);
-  enclave_log("Input: checksumed! %lu\r\n", sum);
+  report[0] = 0;
+  report[1] = checksum_finalize(&input_cs);
+  report[2] = checksum_finalize(&output_cs);
 
+report:
+  free(m1);
+  free(m2);
+  free(m3);
+  ocall(OCALLCMD_MATMUL_COPY_REPORT, report, sizeof(report), NULL, 0);
 }
 
 
@@ -152,7 +197,7 @@ void checksum_init(checksum_state_t *state) {
 }
 
 void checksum(checksum_state_t *state, void *input, size_t size) {
-    for (char *cur = input; cur <= (char *)input + size * sizeof(char); cur++)  {
+    for (char *cur = input; cur < (char *)input + size * sizeof(char); cur++)  {
         for (int i = 0; i < sizeof(char) * 8; i++) {
             *state += (*cur >> i) & 1;
         }
@@ -177,13 +222,13 @@ size_t matrix_mul(float *m1, float *m2, float *m3, size_t *dims1, size_t *dims2)
     }
     size_t a = dim1_c;
 
-    for (int m1r = 0; m1r < dim1_r; m1r++) {
-        for (int m2c = 0; m2c < dim2_c; m2c++) {
+    for (size_t m1r = 0; m1r < dim1_r; m1r++) {
+        for (size_t m2c = 0; m2c < dim2_c; m2c++) {
             float sum = 0;
-            for (int i = 0; i < a; i++) {
-                sum += m1[m1r * a + i] * m2[i * a + m2c];
+            for (size_t i = 0; i < a; i++) {
+                sum += m1[m1r * a + i] * m2[i * dim2_c + m2c];
             }
-            m3[m1r * a + m2c] = sum;
+            m3[m1r * dim2_c + m2c] = sum;
         }
     }
 
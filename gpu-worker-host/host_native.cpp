@@ -6,11 +6,23 @@
 #include <edge_call.h>
 #include <keystone.h>
 #include <rpc/server.h>
+#include <rpc/this_handler.h>
 #include <optional>
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <shared_mutex>
+#include <algorithm>
+#include <memory>
+#include <tuple>
+#include <future>
+#include <unordered_map>
+#include <atomic>
+#include <random>
+#include <pthread.h>
 #include "shared_buffer.h"
+#include "trace.h"
+#include "scheduler.h"
 
 using namespace std::chrono_literals;
 
@@ -29,7 +41,35 @@ using namespace std::chrono_literals;
 #define OCALLCMD_MATMUL_GET_MATRIX_DIMS 100
 #define OCALLCMD_MATMUL_GET_MATRIX_IN 101
 #define OCALLCMD_MATMUL_COPY_REPORT 102
+#define OCALLCMD_MATMUL_PUT_MATRIX_OUT 103
 
+// Don't bother fanning a matmul out to another enclave for fewer rows
+// than this, copying the right-hand matrix in costs more than it saves.
+#define MATMUL_MIN_PARTITION_ROWS 16
+
+// Free memory of each enclave, and how much of it a matmul partition may
+// use for its matrices; the rest is left to the eapp and its runtime.
+#define ENCLAVE_FREE_MEM_BYTES (64ul * 1024 * 1024)
+#define MATMUL_ENCLAVE_BUDGET_BYTES (ENCLAVE_FREE_MEM_BYTES - 8ul * 1024 * 1024)
+
+// Largest matmul output the host allocates for a single job
+#define MATMUL_MAX_OUTPUT_BYTES (1024ul * 1024 * 1024)
+
+// Upper bound on matrices staged on the host between RPCs, such that
+// clients streaming in large jobs can't exhaust host memory.
+#define MATRIX_STORE_MAX_BYTES (1024ul * 1024 * 1024)
+// Staged matrices not used for this long are dropped, such that ones
+// leaked by clients don't take up the store for good.
+#define MATRIX_STORE_TTL 60s
+
+// Enclave jobs allowed to wait for their turn, beyond that they are
+// rejected.
+#define SCHED_MAX_QUEUED 16
+
+// Every running or queued enclave job holds on to an RPC worker thread.
+// Threads beyond those, such that rejecting jobs, staging, tracing and
+// lifecycle calls are always served.
+#define RPC_SPARE_WORKER_THREADS 16
 
 unsigned long
 print_string(char* str);
@@ -50,65 +90,123 @@ print_string(char* str) {
 
 struct EnclaveWrapper {
 public:
-  EnclaveWrapper(std::vector<uint8_t> enclaveAppBinary, std::vector<uint8_t> runtimeBinary, std::vector<uint8_t> loader);
+  EnclaveWrapper(std::vector<uint8_t> enclaveAppBinary, std::vector<uint8_t> runtimeBinary, std::vector<uint8_t> loader, unsigned int hart);
   EnclaveWrapper(const EnclaveWrapper&) = delete;
   EnclaveWrapper(const EnclaveWrapper&&) = delete;
+  ~EnclaveWrapper();
 
+  bool waitInitialized();
+  bool exited();
   void registerCallDispatch(std::function<bool(SharedBuffer&)>);
-  void waitCallDispatchDeregistered();
+  bool waitCallDispatchDeregistered();
  
 private: 
   Keystone::Enclave enclave;
   Keystone::Params params;
+  // Only held until the enclave has been initialized
   std::vector<uint8_t> enclaveAppBinary, runtimeBinary, loaderBinary;
-  Keystone::ElfFile *enclaveAppFile, *runtimeFile, *loaderFile;
   std::thread enclaveThread;
+  std::promise<bool> initialized;
+  std::future<bool> initializedFuture;
   std::optional<std::function<bool(SharedBuffer&)>> rpcCallDispatch;
+  bool exitRequested = false;
+  bool enclaveExited = false;
   std::mutex rpcCallDispatchLock;
   std::condition_variable rpcCallDispatchCV;
+  unsigned int hart;
 
   void incomingOcall(void* buffer);
 };
 
-EnclaveWrapper::EnclaveWrapper(std::vector<uint8_t> enclaveAppBinary, std::vector<uint8_t> runtimeBinary, std::vector<uint8_t> loaderBinary) : enclaveAppBinary(enclaveAppBinary), runtimeBinary(runtimeBinary), loaderBinary(loaderBinary) {
+EnclaveWrapper::EnclaveWrapper(std::vector<uint8_t> enclaveAppBinary, std::vector<uint8_t> runtimeBinary, std::vector<uint8_t> loaderBinary, unsigned int hart) : enclaveAppBinary(std::move(enclaveAppBinary)), runtimeBinary(std::move(runtimeBinary)), loaderBinary(std::move(loaderBinary)), initializedFuture(initialized.get_future()), hart(hart) {
   enclaveThread = std::thread([this]() {
-    this->params.setFreeMemSize(64 * 1024 * 1024);
+    // Keep each enclave on its own hart, such that partitions of a single
+    // job actually run in parallel.
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(this->hart, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    Trace::set_thread_name("enclave (hart " + std::to_string(this->hart) + ")");
+
+    this->params.setFreeMemSize(ENCLAVE_FREE_MEM_BYTES);
     //this->params.setSimulated(true);
     this->params.setUntrustedMem(DEFAULT_UNTRUSTED_PTR, 1024 * 1024);
-    
-    void *enclaveAppAddr = this->enclaveAppBinary.data();
-    //std::cout << "Pointer???? " << enclaveAppAddr << std::endl;
-    std::vector<uint8_t> newLoaderBinary = this->loaderBinary;
-    std::cout << "File pointers: " << (void*) this->enclaveAppBinary.data() << ", " << (void*) this->runtimeBinary.data() << ", " << (void*) this->loaderBinary.data() << std::endl;
-    std::cout << "File pointers: " << (void*) this->enclaveAppBinary.data() << ", " << (void*) this->runtimeBinary.data() << ", " << (void*) newLoaderBinary.data() << std::endl;
-
-    this->enclaveAppFile = new Keystone::ElfFile(this->enclaveAppBinary.data(), this->enclaveAppBinary.size());
-    this->runtimeFile = new Keystone::ElfFile(this->runtimeBinary.data(), this->runtimeBinary.size());
-    this->loaderFile = new Keystone::ElfFile(newLoaderBinary.data(), newLoaderBinary.size());
 
     std::cout << "Host: Initializing enclave..." << std::endl;
-    enclave.init(this->enclaveAppFile, this->runtimeFile, this->loaderFile, this->params, (uintptr_t)0);
+    Keystone::Error initError;
+    {
+      // The binaries have been copied into enclave memory once init
+      // returns, so drop them right away.
+      auto enclaveAppFile = std::make_unique<Keystone::ElfFile>(this->enclaveAppBinary.data(), this->enclaveAppBinary.size());
+      auto runtimeFile = std::make_unique<Keystone::ElfFile>(this->runtimeBinary.data(), this->runtimeBinary.size());
+      auto loaderFile = std::make_unique<Keystone::ElfFile>(this->loaderBinary.data(), this->loaderBinary.size());
+      initError = enclave.init(enclaveAppFile.get(), runtimeFile.get(), loaderFile.get(), this->params, (uintptr_t)0);
+    }
+    std::vector<uint8_t>().swap(this->enclaveAppBinary);
+    std::vector<uint8_t>().swap(this->runtimeBinary);
+    std::vector<uint8_t>().swap(this->loaderBinary);
+    initialized.set_value(initError == Keystone::Error::Success);
 
-    std::cout << "Host: Initializing enclave..." << std::endl;
-    enclave.registerOcallDispatch([this](void* buffer) {
-      return this->incomingOcall(buffer);
-    });
+    if (initError == Keystone::Error::Success) {
+      enclave.registerOcallDispatch([this](void* buffer) {
+        return this->incomingOcall(buffer);
+      });
 
-    std::cout << "Host: Initializing enclave..." << std::endl;
-    /* We must specifically register functions we want to export to the
-       enclave. */
-    //register_call(OCALL_PRINT_STRING, print_string_wrapper);
+      /* We must specifically register functions we want to export to the
+         enclave. */
+      //register_call(OCALL_PRINT_STRING, print_string_wrapper);
 
-    std::cout << "Host: Initializing enclave..." << std::endl;
-    edge_call_init_internals(
-        (uintptr_t)this->enclave.getSharedBuffer(), this->enclave.getSharedBufferSize());
+      edge_call_init_internals(
+          (uintptr_t)this->enclave.getSharedBuffer(), this->enclave.getSharedBufferSize());
 
-    std::cout << "Host: Running enclave..." << std::endl;
-    this->enclave.run();
-    std::cout << "Host: Enclave finished!" << std::endl;
+      std::cout << "Host: Running enclave..." << std::endl;
+      this->enclave.run();
+      std::cout << "Host: Enclave finished!" << std::endl;
+    } else {
+      std::cout << "Host: Failed to initialize enclave!" << std::endl;
+    }
+
+    // Release anyone still waiting on this enclave
+    {
+      std::lock_guard<std::mutex> rpcCallDispatchLg(rpcCallDispatchLock);
+      enclaveExited = true;
+      rpcCallDispatch = std::nullopt;
+    }
+    rpcCallDispatchCV.notify_all();
   });
 }
 
+// Runs in user thread
+//
+// Blocks until enclave init has finished, returns whether it succeeded.
+// Must only be called once.
+bool EnclaveWrapper::waitInitialized() {
+  return initializedFuture.get();
+}
+
+// Runs in user thread
+//
+// Whether the enclave has stopped running, or never came up at all.
+bool EnclaveWrapper::exited() {
+  std::lock_guard<std::mutex> rpcCallDispatchLg(rpcCallDispatchLock);
+  return enclaveExited;
+}
+
+// Runs in user thread
+//
+// Must not be called while a call dispatch is registered. Sends the
+// enclave out of its event loop, waits for it to return and destroys it.
+EnclaveWrapper::~EnclaveWrapper() {
+  {
+    std::lock_guard<std::mutex> rpcCallDispatchLg(rpcCallDispatchLock);
+    exitRequested = true;
+  }
+  rpcCallDispatchCV.notify_all();
+
+  enclaveThread.join();
+  enclave.destroy();
+}
+
 // Runs in enclave thread
 //
 // if we have the rpcCallDispatch non-null, then call that,
@@ -116,22 +214,31 @@ EnclaveWrapper::EnclaveWrapper(std::vector<uint8_t> enclaveAppBinary, std::vecto
 // for condvar. Any other ocall while not in sleep is illegal
 // and should crash.
 void EnclaveWrapper::incomingOcall(void* buffer) {
-    std::cout << "Host: Received enclave ocall" << std::endl;
-    std::unique_lock<std::mutex> rpcCallDispatchLg(rpcCallDispatchLock);
     SharedBuffer shbuf(enclave.getSharedBuffer(), enclave.getSharedBufferSize());
     struct edge_call* edge_call = (struct edge_call*)shbuf.ptr();
+    TRACE_SCOPE(TRACE_LEVEL_OCALL, "ocall", "ocall", edge_call->call_id);
+
+    // Log messages may be sent at any time, independent of the call
+    // currently being dispatched.
+    if (edge_call->call_id == OCALLCMD_LOG_MSG) {
+      auto msg = shbuf.get_c_string_or_set_bad_offset();
+      if (msg.has_value()) {
+        printf("Enclave %u said: %s", hart, msg.value());
+        shbuf.setup_ret_or_bad_ptr(0);
+      }
+      return;
+    }
 
+    std::unique_lock<std::mutex> rpcCallDispatchLg(rpcCallDispatchLock);
     if (rpcCallDispatch.has_value()) {
-      std::cout << "Host: Enclave event loop call, dispatching..." << std::endl;
       if (!(*rpcCallDispatch)(shbuf)) {
         rpcCallDispatch = std::nullopt;
         rpcCallDispatchCV.notify_all();
       }
     } else if (edge_call->call_id == 1) {
-      std::cout << "Host: Enclave event loop, waiting for CV!" << std::endl;
-      rpcCallDispatchCV.wait(rpcCallDispatchLg, [this]() { return this->rpcCallDispatch.has_value(); });
-      std::cout << "Host: Got CV notify, returning to eapp!" << std::endl;
-      shbuf.setup_ret_or_bad_ptr(1);
+      TRACE_SCOPE(TRACE_LEVEL_OCALL, "ocall", "ev_loop_idle");
+      rpcCallDispatchCV.wait(rpcCallDispatchLg, [this]() { return this->rpcCallDispatch.has_value() || this->exitRequested; });
+      shbuf.setup_ret_or_bad_ptr(exitRequested ? OCALLRET_EXIT : OCALLRET_EV_LOOP);
     } else {
       std::cout << "Host: Enclave made illegal ocall from main event loop!" << std::endl;
     }
@@ -158,9 +265,13 @@ void EnclaveWrapper::incomingOcall(void* buffer) {
 //    }
 //}
 void EnclaveWrapper::registerCallDispatch(std::function<bool(SharedBuffer&)> dispatchFn) {
-    // 1. Set rpcCallDispatch mutex to dispatchFn
+    // 1. Set rpcCallDispatch mutex to dispatchFn, unless there is no
+    //    enclave left to ever call it
     {
       std::lock_guard<std::mutex> rpcCallDispatchLg(rpcCallDispatchLock);
+      if (enclaveExited) {
+        return;
+      }
       rpcCallDispatch.emplace(dispatchFn);
     }
 
@@ -168,9 +279,500 @@ void EnclaveWrapper::registerCallDispatch(std::function<bool(SharedBuffer&)> dis
     rpcCallDispatchCV.notify_all();
 }
 
-void EnclaveWrapper::waitCallDispatchDeregistered() {
+// Returns false if the enclave exited before the dispatch was done.
+bool EnclaveWrapper::waitCallDispatchDeregistered() {
   std::unique_lock<std::mutex> rpcCallDispatchLg(rpcCallDispatchLock);
   rpcCallDispatchCV.wait(rpcCallDispatchLg, [this]() { return !this->rpcCallDispatch.has_value(); });
+  return !enclaveExited;
+}
+
+// A single enclave instance, and whether a job currently runs on it
+struct EnclaveSlot {
+  std::unique_ptr<EnclaveWrapper> wrapper;
+  bool busy = false;
+};
+
+// All enclave slots. Jobs hold the lifecycle lock shared for their whole
+// duration, lifecycle operations hold it exclusively, such that no job
+// ever sees enclaves being torn down or replaced midway.
+struct EnclavePool {
+  explicit EnclavePool(size_t count) : slots(count) {}
+
+  std::vector<EnclaveSlot> slots;
+
+  // The slots a job runs on, handed back to the pool when it goes out of
+  // scope.
+  struct Lease {
+    Lease(EnclavePool& pool, size_t count) : pool(pool), poolLg(pool.lockForJob()), slots(pool.reserve(count)) {}
+    Lease(const Lease&) = delete;
+    ~Lease() { pool.release(slots); }
+
+    EnclavePool& pool;
+    std::shared_lock<std::shared_mutex> poolLg;
+    std::vector<EnclaveSlot*> slots;
+  };
+
+  // Runs in user thread
+  //
+  // Leases up to `count` live enclaves that no other job is running on,
+  // waiting until at least one is free. Slots whose enclave failed init
+  // or has exited are skipped; the lease is empty if there are none left.
+  Lease acquire(size_t count) {
+    return Lease(*this, count);
+  }
+
+  // Enclaves that came up in the last lifecycle operation, readable
+  // without waiting for one that is in progress
+  size_t liveCount() {
+    return live;
+  }
+
+  // Lifecycle lock held
+  void setLiveCount(size_t count) {
+    live = count;
+  }
+
+  std::unique_lock<std::shared_mutex> lockForLifecycle() {
+    std::lock_guard<std::mutex> gateLg(gate);
+    return std::unique_lock<std::shared_mutex>(lifecycleLock);
+  }
+
+private:
+  static bool isLive(EnclaveSlot& slot) {
+    return slot.wrapper && !slot.wrapper->exited();
+  }
+
+  std::shared_lock<std::shared_mutex> lockForJob() {
+    // Passing through the gate keeps a steady stream of jobs from
+    // starving a waiting lifecycle operation.
+    std::lock_guard<std::mutex> gateLg(gate);
+    return std::shared_lock<std::shared_mutex>(lifecycleLock);
+  }
+
+  std::vector<EnclaveSlot*> reserve(size_t count) {
+    std::unique_lock<std::mutex> busyLg(busyLock);
+    busyCV.wait(busyLg, [this]() {
+      bool anyBusy = false;
+      for (auto& slot : slots) {
+        if (isLive(slot)) {
+          if (!slot.busy) {
+            return true;
+          }
+          anyBusy = true;
+        }
+      }
+      return !anyBusy;
+    });
+
+    std::vector<EnclaveSlot*> reserved;
+    for (auto& slot : slots) {
+      if (reserved.size() < count && isLive(slot) && !slot.busy) {
+        reserved.push_back(&slot);
+        slot.busy = true;
+      }
+    }
+    return reserved;
+  }
+
+  void release(std::vector<EnclaveSlot*>& leased) {
+    {
+      std::lock_guard<std::mutex> busyLg(busyLock);
+      for (EnclaveSlot* slot : leased) {
+        slot->busy = false;
+      }
+    }
+    busyCV.notify_all();
+  }
+
+  std::mutex gate;
+  std::shared_mutex lifecycleLock;
+  std::atomic<size_t> live = 0;
+  // Guards the slots' busy flags
+  std::mutex busyLock;
+  std::condition_variable busyCV;
+};
+
+// Same bit-counting checksum as the eapp, used to validate what went into
+// and came out of each enclave.
+static uint64_t
+checksum(const void* input, size_t size) {
+  uint64_t state = 0;
+  for (const uint8_t* cur = (const uint8_t*)input; cur < (const uint8_t*)input + size; cur++) {
+    state += __builtin_popcount(*cur);
+  }
+  return state;
+}
+
+// One row band of a partitioned matmul: rows [rowBegin, rowBegin + rows)
+// of the left-hand and output matrices.
+struct MatmulPartition {
+  size_t rowBegin, rows;
+  uint64_t inputChecksum = 0, outputChecksum = 0;
+  bool ok = false;
+};
+
+// Most rows of the left-hand matrix a single enclave can take on, next
+// to all of the right-hand matrix and its band of the output. 0 if not
+// even a single row fits.
+static size_t
+matmulMaxBandRows(size_t inner, size_t cols) {
+  size_t bBytes = inner * cols * sizeof(float);
+  if (bBytes >= MATMUL_ENCLAVE_BUDGET_BYTES) {
+    return 0;
+  }
+  return (MATMUL_ENCLAVE_BUDGET_BYTES - bBytes) / ((inner + cols) * sizeof(float));
+}
+
+// Splits into at least as many bands as fit into enclave memory, and
+// otherwise into one band per enclave.
+static std::vector<MatmulPartition>
+partitionRows(size_t rows, size_t inner, size_t cols, size_t enclaves) {
+  size_t maxBandRows = matmulMaxBandRows(inner, cols);
+  size_t parts = std::max(
+    std::clamp(rows / MATMUL_MIN_PARTITION_ROWS, (size_t)1, enclaves),
+    (rows + maxBandRows - 1) / maxBandRows);
+  std::vector<MatmulPartition> partitions;
+  for (size_t i = 0, rowBegin = 0; i < parts; i++) {
+    // Spread the remainder over the first bands
+    size_t bandRows = rows / parts + (i < rows % parts ? 1 : 0);
+    partitions.push_back(MatmulPartition { rowBegin, bandRows });
+    rowBegin += bandRows;
+  }
+  return partitions;
+}
+
+// Runs in user thread
+//
+// Streams the partition's band of `a` and all of `b` into the enclave in
+// the (leased) `slot`, and gathers its band of the output straight into
+// `c`.
+static void
+runMatmulPartition(EnclaveSlot& slot, size_t inner, size_t cols, const float* a, const float* b, float* c, MatmulPartition& part) {
+  TRACE_SCOPE(TRACE_LEVEL_RPC, "job", "matmul_partition", part.rows);
+
+  if (!slot.wrapper) {
+    return;
+  }
+
+  size_t dims[3] = { part.rows, inner, cols };
+  const uint8_t* inSrc[2] = {
+    (const uint8_t*)(a + part.rowBegin * inner), (const uint8_t*)b };
+  size_t inLen[2] = {
+    part.rows * inner * sizeof(float), inner * cols * sizeof(float) };
+  size_t inIdx = 0, inOffset = 0;
+  uint8_t* out = (uint8_t*)(c + part.rowBegin * cols);
+  size_t outLen = part.rows * cols * sizeof(float), outOffset = 0;
+  bool finished = false;
+
+  (*slot.wrapper).registerCallDispatch([&](SharedBuffer& shbuf) {
+    struct edge_call* edge_call = (struct edge_call*)shbuf.ptr();
+    size_t maxChunk = shbuf.size() - sizeof(struct edge_call) - sizeof(struct edge_data);
+
+    if (edge_call->call_id == OCALLCMD_EV_LOOP) {
+      shbuf.setup_ret_or_bad_ptr(OCALLRET_START_MATMUL);
+    } else if (edge_call->call_id == OCALLCMD_MATMUL_GET_MATRIX_DIMS) {
+      shbuf.setup_wrapped_ret_or_bad_ptr(dims, sizeof(dims));
+    } else if (edge_call->call_id == OCALLCMD_MATMUL_GET_MATRIX_IN) {
+      // Both input matrices are handed out back to back, an empty chunk
+      // signals that everything has been sent already.
+      if (inIdx == 0 && inOffset == inLen[0]) {
+        inIdx = 1;
+        inOffset = 0;
+      }
+      size_t len = std::min(inLen[inIdx] - inOffset, maxChunk);
+      TRACE_SCOPE(TRACE_LEVEL_OCALL, "copy", "matrix_in", len);
+      shbuf.setup_wrapped_ret_or_bad_ptr(inSrc[inIdx] + inOffset, len);
+      inOffset += len;
+    } else if (edge_call->call_id == OCALLCMD_MATMUL_PUT_MATRIX_OUT) {
+      auto chunk = shbuf.get_bytes_or_set_bad_offset();
+      if (chunk.has_value()) {
+        size_t len = std::min(chunk.value().second, outLen - outOffset);
+        TRACE_SCOPE(TRACE_LEVEL_OCALL, "copy", "matrix_out", len);
+        memcpy(out + outOffset, chunk.value().first, len);
+        outOffset += len;
+        shbuf.setup_ret_or_bad_ptr(len);
+      }
+    } else if (edge_call->call_id == OCALLCMD_MATMUL_COPY_REPORT) {
+      // Report is { status, input checksum, output checksum }
+      auto report = shbuf.get_bytes_or_set_bad_offset();
+      if (report.has_value() && report.value().second == sizeof(size_t) * 3) {
+        size_t r[3];
+        memcpy(r, report.value().first, sizeof(r));
+        part.inputChecksum = r[1];
+        part.outputChecksum = r[2];
+        part.ok = r[0] == 0 && outOffset == outLen
+          && part.inputChecksum == checksum(dims, sizeof(dims))
+                                   + checksum(inSrc[0], inLen[0])
+                                   + checksum(inSrc[1], inLen[1])
+          && part.outputChecksum == checksum(out, outLen);
+      }
+      finished = true;
+      shbuf.setup_ret_or_bad_ptr(0);
+    } else {
+      std::cout << "Host: Got spurious call!" << std::endl;
+      shbuf.setup_ret_or_bad_ptr(OCALLRET_EXIT);
+    }
+
+    return !finished;
+  });
+
+  if (!(*slot.wrapper).waitCallDispatchDeregistered()) {
+    part.ok = false;
+  }
+}
+
+// Checks the input sizes match, and that both the output and each
+// partition's enclave footprint stay within bounds, such that nothing
+// needs to be allocated before rejecting a job.
+static bool
+validMatmulDims(uint64_t rows, uint64_t inner, uint64_t cols, size_t aSize, size_t bSize) {
+  return rows != 0 && inner != 0 && cols != 0
+    && aSize / rows == inner && aSize % rows == 0
+    && bSize / inner == cols && bSize % inner == 0
+    && cols <= MATMUL_MAX_OUTPUT_BYTES / sizeof(float) / rows
+    && matmulMaxBandRows(inner, cols) > 0;
+}
+
+// Enclaves a matmul is worth spreading over, small jobs only take a few
+// and leave the rest to other jobs.
+static size_t
+matmulWidth(EnclavePool& pool, size_t rows) {
+  return std::clamp(rows / MATMUL_MIN_PARTITION_ROWS, (size_t)1, std::max(pool.liveCount(), (size_t)1));
+}
+
+struct MatmulResult {
+  bool ok = true;
+  uint64_t inputChecksum = 0, outputChecksum = 0;
+};
+
+// Runs in user thread
+//
+// Multiplies a (rows x inner) by b (inner x cols) into c, all row-major.
+// The job is split into row bands which run on up to `width` separate
+// enclaves in parallel, the checksums are summed over all partitions.
+// Bands go to whichever live enclaves are free.
+static MatmulResult
+runMatmul(EnclavePool& pool, size_t width, size_t rows, size_t inner, size_t cols, const float* a, const float* b, float* c) {
+  auto lease = pool.acquire(width);
+  if (lease.slots.empty()) {
+    MatmulResult result;
+    result.ok = false;
+    return result;
+  }
+  auto partitions = partitionRows(rows, inner, cols, lease.slots.size());
+
+  // Scatter: one worker per leased enclave, each taking bands until none
+  // are left. The first worker runs on this thread, and if fewer threads
+  // can be started, the running workers pick up the remaining bands.
+  std::atomic<size_t> nextPartition = 0;
+  auto worker = [&](EnclaveSlot& slot) {
+    for (size_t i; (i = nextPartition++) < partitions.size();) {
+      runMatmulPartition(slot, inner, cols, a, b, c, partitions[i]);
+    }
+  };
+  std::vector<std::thread> workers;
+  try {
+    for (size_t i = 1; i < std::min(partitions.size(), lease.slots.size()); i++) {
+      workers.emplace_back(worker, std::ref(*lease.slots[i]));
+    }
+  } catch (const std::system_error&) {
+  }
+  try {
+    worker(*lease.slots[0]);
+  } catch (...) {
+    nextPartition = partitions.size();
+    for (auto& w : workers) {
+      w.join();
+    }
+    throw;
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+
+  // Gather: output bands are written in place, only combine the results
+  MatmulResult result;
+  for (size_t i = 0; i < partitions.size(); i++) {
+    result.ok = result.ok && partitions[i].ok;
+    result.inputChecksum += partitions[i].inputChecksum;
+    result.outputChecksum += partitions[i].outputChecksum;
+  }
+  return result;
+}
+
+// Matrices uploaded in chunks by clients, referenced by id in later RPCs.
+// Ids are random, such that clients can't guess and release each other's
+// matrices, and matrices expire after MATRIX_STORE_TTL without use.
+struct MatrixStore {
+  struct Entry {
+    std::shared_ptr<std::vector<float>> matrix;
+    std::chrono::steady_clock::time_point lastUsed;
+  };
+
+  std::mutex lock;
+  std::unordered_map<uint64_t, Entry> matrices;
+  std::mt19937_64 ids { std::random_device()() };
+  size_t bytes = 0;
+
+  // Returns 0 for empty matrices, which would slip past the size limit,
+  // or if the store is full
+  uint64_t create(size_t count) {
+    if (count == 0) {
+      return 0;
+    }
+    std::lock_guard<std::mutex> storeLg(lock);
+    auto now = std::chrono::steady_clock::now();
+    expire(now);
+    if (count > (MATRIX_STORE_MAX_BYTES - bytes) / sizeof(float)) {
+      return 0;
+    }
+
+    uint64_t id;
+    do {
+      id = ids();
+    } while (id == 0 || matrices.count(id));
+    matrices.emplace(id, Entry { std::make_shared<std::vector<float>>(count), now });
+    bytes += count * sizeof(float);
+    return id;
+  }
+
+  // Also keeps the matrix from expiring for another MATRIX_STORE_TTL
+  std::shared_ptr<std::vector<float>> get(uint64_t id) {
+    std::lock_guard<std::mutex> storeLg(lock);
+    auto it = matrices.find(id);
+    if (it == matrices.end()) {
+      return nullptr;
+    }
+    it->second.lastUsed = std::chrono::steady_clock::now();
+    return it->second.matrix;
+  }
+
+  // Copies `chunk` into the matrix at `offset`. Done under the store lock,
+  // such that no job can pick the matrix up midway, and refused while a
+  // job holds it, which might be reading it right now.
+  bool write(uint64_t id, size_t offset, const std::vector<float>& chunk) {
+    std::lock_guard<std::mutex> storeLg(lock);
+    auto it = matrices.find(id);
+    if (it == matrices.end() || it->second.matrix.use_count() > 1) {
+      return false;
+    }
+    std::vector<float>& m = *it->second.matrix;
+    if (offset > m.size() || chunk.size() > m.size() - offset) {
+      return false;
+    }
+    std::copy(chunk.begin(), chunk.end(), m.begin() + offset);
+    it->second.lastUsed = std::chrono::steady_clock::now();
+    return true;
+  }
+
+  bool release(uint64_t id) {
+    std::lock_guard<std::mutex> storeLg(lock);
+    auto it = matrices.find(id);
+    if (it == matrices.end()) {
+      return false;
+    }
+    bytes -= it->second.matrix->size() * sizeof(float);
+    matrices.erase(it);
+    return true;
+  }
+
+private:
+  // Drops expired matrices, other than ones a job is still working on
+  void expire(std::chrono::steady_clock::time_point now) {
+    for (auto it = matrices.begin(); it != matrices.end();) {
+      if (now - it->second.lastUsed > MATRIX_STORE_TTL && it->second.matrix.use_count() == 1) {
+        bytes -= it->second.matrix->size() * sizeof(float);
+        it = matrices.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+};
+
+// Runs in RPC worker thread
+//
+// Waits for the scheduler to admit a job taking up `width` enclaves, then
+// runs `fn`. Rejected jobs are answered with an RPC error of { reason,
+// retry after ms } instead, and `rejected` is returned.
+template <typename T, typename F>
+static T
+runScheduled(JobScheduler& scheduler, int priority, uint64_t deadlineMs, uint64_t cost, size_t width, T rejected, F fn) {
+  // Deadlines too far out to represent are as good as none
+  auto now = JobScheduler::Clock::now();
+  auto maxDeadlineMs = std::chrono::duration_cast<std::chrono::milliseconds>(JobScheduler::Clock::time_point::max() - now).count();
+  JobScheduler::Job job = {
+    priority,
+    deadlineMs == 0 || deadlineMs >= (uint64_t)maxDeadlineMs
+      ? JobScheduler::Clock::time_point::max()
+      : now + std::chrono::milliseconds(deadlineMs),
+    cost,
+    width };
+  uint64_t retryAfterMs = 0;
+
+  JobScheduler::Admission admission;
+  {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "job", "queued", cost);
+    admission = scheduler.admit(job, &retryAfterMs);
+  }
+
+  if (admission == JobScheduler::Admission::Overloaded) {
+    rpc::this_handler().respond_error(std::make_tuple(std::string("overloaded"), retryAfterMs));
+    return rejected;
+  } else if (admission == JobScheduler::Admission::DeadlineMissed) {
+    rpc::this_handler().respond_error(std::make_tuple(std::string("deadline_missed"), (uint64_t)0));
+    return rejected;
+  }
+
+  // Hand the job's place back even if fn throws, or no other job would
+  // ever be admitted in its place
+  struct Finish {
+    JobScheduler& scheduler;
+    const JobScheduler::Job& job;
+    JobScheduler::Clock::time_point start;
+    ~Finish() { scheduler.finish(job, JobScheduler::Clock::now() - start); }
+  } finish { scheduler, job, JobScheduler::Clock::now() };
+  return fn();
+}
+
+// Tears down the enclaves in all slots (lifecycle lock held), returns
+// whether any were loaded.
+static bool
+destroyEnclaves(std::vector<EnclaveSlot>& slots) {
+  bool loaded = false;
+  for (auto& slot : slots) {
+    loaded = loaded || slot.wrapper;
+    slot.wrapper.reset();
+  }
+  return loaded;
+}
+
+// Loads the enclave binaries into the slots from `first` on (lifecycle
+// lock held), one per hart. Slots failing init are left empty, returns
+// how many came up.
+static size_t
+loadEnclaves(std::vector<EnclaveSlot>& slots, size_t first, unsigned int harts, const std::vector<uint8_t>& enclaveApp, const std::vector<uint8_t>& runtime, const std::vector<uint8_t>& loader) {
+  for (size_t i = first; i < slots.size(); i++) {
+    slots[i].wrapper = std::make_unique<EnclaveWrapper>(enclaveApp, runtime, loader, i % harts);
+  }
+
+  size_t live = 0;
+  for (size_t i = first; i < slots.size(); i++) {
+    if (slots[i].wrapper->waitInitialized()) {
+      live++;
+    } else {
+      slots[i].wrapper.reset();
+    }
+  }
+  return live;
+}
+
+// Makes the enclaves that came up in a lifecycle operation (lifecycle
+// lock held) available to jobs.
+static void
+setLiveEnclaves(EnclavePool& pool, JobScheduler& scheduler, size_t live) {
+  pool.setLiveCount(live);
+  scheduler.set_capacity(live);
 }
 
 int
@@ -178,103 +780,212 @@ main(int argc, char** argv) {
   // Creating a server that listens on port 8080
   rpc::server srv(5826);
 
+  // One enclave per hart by default, large jobs are split across all of
+  // them.
+  unsigned int harts = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t enclaveCount = argc > 1 ? std::stoul(argv[1]) : harts;
+  if (enclaveCount == 0) {
+    std::cerr << "Usage: " << argv[0] << " [enclaves]" << std::endl;
+    return 1;
+  }
+
   // Host application state
-  std::mutex enclaveWrapperLock;
-  std::optional<EnclaveWrapper> enclaveWrapper = std::nullopt;
+  EnclavePool enclavePool(enclaveCount);
+  std::vector<EnclaveSlot>& enclaveSlots = enclavePool.slots;
+  MatrixStore matrixStore;
+  JobScheduler scheduler(SCHED_MAX_QUEUED, enclavePool.liveCount());
 
   // Preinitialize the enclave parameters:
 
-  srv.bind("eapp", [&enclaveWrapper, &enclaveWrapperLock](std::vector<uint8_t> enclaveApp, std::vector<uint8_t> runtime, std::vector<uint8_t> loader) {
-    std::lock_guard<std::mutex> eclaveWrapperLg(enclaveWrapperLock);
+  srv.bind("eapp", [&enclavePool, &enclaveSlots, &scheduler, harts](std::vector<uint8_t> enclaveApp, std::vector<uint8_t> runtime, std::vector<uint8_t> loader) {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "rpc", "eapp");
+    auto poolLg = enclavePool.lockForLifecycle();
 
-    if (enclaveWrapper.has_value()) {
-      return false;
+    for (auto& slot : enclaveSlots) {
+      if (slot.wrapper) {
+        return false;
+      }
     }
 
-    enclaveWrapper.emplace(
-      std::move(enclaveApp), std::move(runtime), std::move(loader));
-    return true;
+    size_t live = loadEnclaves(enclaveSlots, 0, harts, enclaveApp, runtime, loader);
+    setLiveEnclaves(enclavePool, scheduler, live);
+    return live > 0;
   });
 
-  srv.bind("helloworld", [&enclaveWrapper, &enclaveWrapperLock]() {
-    std::lock_guard<std::mutex> eclaveWrapperLg(enclaveWrapperLock);
+  // Stops and destroys all enclaves, such that "eapp" can be called
+  // again. Waits for running jobs to finish first.
+  srv.bind("destroy", [&enclavePool, &enclaveSlots, &scheduler]() {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "rpc", "destroy");
+    auto poolLg = enclavePool.lockForLifecycle();
+    setLiveEnclaves(enclavePool, scheduler, 0);
+    return destroyEnclaves(enclaveSlots);
+  });
 
-    if (!enclaveWrapper.has_value()) {
-      return false;
+  // Replaces all enclaves with ones running the given binaries. Running
+  // jobs finish on the old build first and later ones only start on the
+  // new build, so no job sees a mix of both. The new build is first
+  // brought up next to the old one in a single enclave; if that fails,
+  // the old build stays. Returns how many enclaves of the new build came
+  // up, 0 if it was rolled back.
+  srv.bind("restart", [&enclavePool, &enclaveSlots, &scheduler, harts](std::vector<uint8_t> enclaveApp, std::vector<uint8_t> runtime, std::vector<uint8_t> loader) {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "rpc", "restart");
+    auto poolLg = enclavePool.lockForLifecycle();
+
+    auto canary = std::make_unique<EnclaveWrapper>(enclaveApp, runtime, loader, 0);
+    if (!canary->waitInitialized()) {
+      return (uint64_t)0;
     }
 
-    bool finished = false;
-
-    (*enclaveWrapper).registerCallDispatch([&finished](SharedBuffer& shbuf) {
-      struct edge_call* edge_call = (struct edge_call*)shbuf.ptr();
-      std::cout << "Host: Got edge call id " << edge_call->call_id << std::endl;
-
-      if (edge_call->call_id == OCALLCMD_EV_LOOP) {
-        // Kick of "hello world" op
-        shbuf.setup_ret_or_bad_ptr(OCALLRET_START_HELLOWORLD);
-      } else if (edge_call->call_id == OCALLCMD_HELLOWORLD_PRINT_STRING) {
-        // Print actual hello world message
-        auto t = shbuf.get_c_string_or_set_bad_offset();
-	if (t.has_value()) {
-	  printf("Enclave said: %s", t.value());
-	  auto ret_val = strlen(t.value());
-	  shbuf.setup_ret_or_bad_ptr(ret_val);
-	}
-
-	finished = true;
-      } else  {
-        std::cout << "Host: Got spurious call!" << std::endl;
-        shbuf.setup_ret_or_bad_ptr(OCALLRET_EXIT);
+    // From here on, only the new build runs. Swap out the remaining slots
+    // one at a time, such that at most one extra enclave exists at once.
+    enclaveSlots[0].wrapper.swap(canary);
+    canary.reset();
+    for (size_t i = 1; i < enclaveSlots.size(); i++) {
+      enclaveSlots[i].wrapper.reset();
+    }
+    size_t live = 1 + loadEnclaves(enclaveSlots, 1, harts, enclaveApp, runtime, loader);
+    setLiveEnclaves(enclavePool, scheduler, live);
+    return (uint64_t)live;
+  });
+
+  srv.bind("helloworld", [&enclavePool, &scheduler]() {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "rpc", "helloworld");
+    return runScheduled(scheduler, 0, 0, 1, 1, false, [&enclavePool]() {
+      auto lease = enclavePool.acquire(1);
+      if (lease.slots.empty()) {
+        return false;
       }
+      std::unique_ptr<EnclaveWrapper>& enclaveWrapper = lease.slots[0]->wrapper;
+
+      bool finished = false;
+
+      (*enclaveWrapper).registerCallDispatch([&finished](SharedBuffer& shbuf) {
+        struct edge_call* edge_call = (struct edge_call*)shbuf.ptr();
+
+        if (edge_call->call_id == OCALLCMD_EV_LOOP) {
+          // Kick of "hello world" op
+          shbuf.setup_ret_or_bad_ptr(OCALLRET_START_HELLOWORLD);
+        } else if (edge_call->call_id == OCALLCMD_HELLOWORLD_PRINT_STRING) {
+          // Print actual hello world message
+          auto t = shbuf.get_c_string_or_set_bad_offset();
+          if (t.has_value()) {
+            printf("Enclave said: %s", t.value());
+            auto ret_val = strlen(t.value());
+            shbuf.setup_ret_or_bad_ptr(ret_val);
+          }
 
-      return !finished;
+          finished = true;
+        } else  {
+          std::cout << "Host: Got spurious call!" << std::endl;
+          shbuf.setup_ret_or_bad_ptr(OCALLRET_EXIT);
+        }
+
+        return !finished;
+      });
+
+      return (*enclaveWrapper).waitCallDispatchDeregistered();
     });
+  });
 
-    (*enclaveWrapper).waitCallDispatchDeregistered();
 
-    return true;
+  // Multiplies a (rows x inner) by b (inner x cols), both row-major.
+  // Higher priority jobs run first, jobs not started within deadlineMs
+  // (0 for none) are dropped. Returns { ok, result, input checksum,
+  // output checksum }.
+  srv.bind("matmul", [&enclavePool, &scheduler](uint64_t rows, uint64_t inner, uint64_t cols, std::vector<float> a, std::vector<float> b, int priority, uint64_t deadlineMs) {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "rpc", "matmul", rows * inner * cols);
+    auto failed = std::make_tuple(false, std::vector<float>(), (uint64_t)0, (uint64_t)0);
+
+    if (!validMatmulDims(rows, inner, cols, a.size(), b.size())) {
+      return failed;
+    }
+
+    size_t width = matmulWidth(enclavePool, rows);
+    return runScheduled(scheduler, priority, deadlineMs, rows * inner * cols, width, failed, [&]() {
+      std::vector<float> c(rows * cols);
+      MatmulResult result = runMatmul(enclavePool, width, rows, inner, cols, a.data(), b.data(), c.data());
+      if (!result.ok) {
+        c = std::vector<float>();
+      }
+      // The output may be up to MATMUL_MAX_OUTPUT_BYTES, don't copy it
+      return std::make_tuple(result.ok, std::move(c), result.inputChecksum, result.outputChecksum);
+    });
   });
 
+  // Staged matrices, for clients streaming large jobs in and out in
+  // chunks rather than as a single message. Ids are never 0, and matrices
+  // unused for MATRIX_STORE_TTL are dropped. Matrices in use by a job
+  // can't be written to.
+  srv.bind("matrix_create", [&matrixStore](uint64_t count) {
+    return matrixStore.create(count);
+  });
 
-  srv.bind("matmul", [&enclaveWrapper, &enclaveWrapperLock]() {
-    std::lock_guard<std::mutex> eclaveWrapperLg(enclaveWrapperLock);
+  srv.bind("matrix_write", [&matrixStore](uint64_t id, uint64_t offset, std::vector<float> chunk) {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "rpc", "matrix_write", chunk.size());
+    return matrixStore.write(id, offset, chunk);
+  });
 
-    if (!enclaveWrapper.has_value()) {
-      return false;
+  srv.bind("matrix_read", [&matrixStore](uint64_t id, uint64_t offset, uint64_t count) {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "rpc", "matrix_read", count);
+    auto m = matrixStore.get(id);
+    if (!m || offset > m->size()) {
+      return std::vector<float>();
+    }
+    auto begin = m->begin() + offset;
+    return std::vector<float>(begin, begin + std::min(count, m->size() - offset));
+  });
+
+  srv.bind("matrix_release", [&matrixStore](uint64_t id) {
+    return matrixStore.release(id);
+  });
+
+  // Like "matmul", on staged matrices. Returns { ok, result id, input
+  // checksum, output checksum }, the result is staged as well.
+  srv.bind("matmul_stored", [&enclavePool, &matrixStore, &scheduler](uint64_t rows, uint64_t inner, uint64_t cols, uint64_t aId, uint64_t bId, int priority, uint64_t deadlineMs) {
+    TRACE_SCOPE(TRACE_LEVEL_RPC, "rpc", "matmul_stored", rows * inner * cols);
+    auto a = matrixStore.get(aId);
+    auto b = matrixStore.get(bId);
+    auto failed = std::make_tuple(false, (uint64_t)0, (uint64_t)0, (uint64_t)0);
+
+    if (!a || !b || !validMatmulDims(rows, inner, cols, a->size(), b->size())) {
+      return failed;
     }
 
-    bool finished = false;
-
-    (*enclaveWrapper).registerCallDispatch([&finished](SharedBuffer& shbuf) {
-      struct edge_call* edge_call = (struct edge_call*)shbuf.ptr();
-      std::cout << "Host: Got edge call id " << edge_call->call_id << std::endl;
-
-      if (edge_call->call_id == OCALLCMD_EV_LOOP) {
-        shbuf.setup_ret_or_bad_ptr(OCALLRET_START_MATMUL);
-      } else if (edge_call->call_id == OCALLCMD_MATMUL_GET_MATRIX_DIMS) {
-        size_t dims[2] = { 2, 2 };
-        shbuf.setup_wrapped_ret(dims, sizeof(size_t) * 2);
-      } else if (edge_call->call_id == OCALLCMD_MATMUL_GET_MATRIX_IN) {
-        float in[4] = { 0.6, 1.0, 1.0, 1.0 };
-        shbuf.setup_wrapped_ret(in, sizeof(float) * 4);
-      } else if (edge_call->call_id == OCALLCMD_MATMUL_COPY_REPORT) {
-        finished = true;
-        shbuf.setup_ret_or_bad_ptr(0);
-      } else {
-        std::cout << "Host: Got spurious call!" << std::endl;
-        shbuf.setup_ret_or_bad_ptr(OCALLRET_EXIT);
+    size_t width = matmulWidth(enclavePool, rows);
+    return runScheduled(scheduler, priority, deadlineMs, rows * inner * cols, width, failed, [&]() {
+      uint64_t cId = matrixStore.create(rows * cols);
+      auto c = matrixStore.get(cId);
+      if (!c) {
+        return failed;
       }
 
-      return !finished;
+      MatmulResult result = runMatmul(enclavePool, width, rows, inner, cols, a->data(), b->data(), c->data());
+      if (!result.ok) {
+        matrixStore.release(cId);
+        cId = 0;
+      } else {
+        // Give the client a full MATRIX_STORE_TTL to fetch the result, no
+        // matter how long the job took
+        matrixStore.get(cId);
+      }
+      return std::make_tuple(result.ok, cId, result.inputChecksum, result.outputChecksum);
     });
+  });
 
-    (*enclaveWrapper).waitCallDispatchDeregistered();
+  // Hands out all events traced since the last call as Chrome trace JSON
+  srv.bind("trace", []() {
+    return Trace::export_chrome_json();
+  });
 
-    return true;
+  srv.bind("trace_level", [](int level) {
+    Trace::set_level(level);
   });
 
   std::cout << "Host: Listening for incoming RPC requests!" << std::endl;
-  srv.run();
+  srv.async_run(enclaveCount + SCHED_MAX_QUEUED + RPC_SPARE_WORKER_THREADS);
+
+  // All work happens on the RPC worker threads from here on
+  std::promise<void>().get_future().wait();
 
   return 0;
 }
@@ -0,0 +1,150 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+size_t
+JobScheduler::width(const Job& job) {
+  return std::min(std::max(job.width, (size_t)1), capacity_);
+}
+
+int64_t
+JobScheduler::effective_priority(const Waiter& w, Clock::time_point now) {
+  return std::min(std::max(w.job.priority, SCHED_MIN_PRIORITY),
+                  SCHED_MAX_PRIORITY) +
+         (now - w.enqueued) / SCHED_AGING_INTERVAL;
+}
+
+bool
+JobScheduler::runs_before(
+    const Waiter& a, const Waiter& b, Clock::time_point now) {
+  int64_t a_priority = effective_priority(a, now);
+  int64_t b_priority = effective_priority(b, now);
+  if (a_priority != b_priority) return a_priority > b_priority;
+  if (a.job.cost != b.job.cost) return a.job.cost < b.job.cost;
+  return a.seq < b.seq;
+}
+
+/* Admits waiting jobs in order for as long as they fit, returns whether
+ * any were. Deciding here rather than in each waiter keeps the order
+ * consistent while priorities age. */
+bool
+JobScheduler::dispatch() {
+  Clock::time_point now = Clock::now();
+  bool any = false;
+  for (;;) {
+    Waiter* best = nullptr;
+    for (Waiter& w : queue_) {
+      if (!w.admitted && (!best || runs_before(w, *best, now))) {
+        best = &w;
+      }
+    }
+    if (!best) return any;
+    size_t granted = width(best->job);
+    if (used_ + granted > capacity_) return any;
+
+    best->job.width = granted;
+    best->admitted = true;
+    used_ += granted;
+    any = true;
+  }
+}
+
+JobScheduler::Waiter&
+JobScheduler::waiter(uint64_t seq) {
+  return *std::find_if(queue_.begin(), queue_.end(), [seq](const Waiter& w) {
+    return w.seq == seq;
+  });
+}
+
+void
+JobScheduler::dequeue(uint64_t seq) {
+  auto it = std::find_if(queue_.begin(), queue_.end(), [seq](const Waiter& w) {
+    return w.seq == seq;
+  });
+  queued_cost_ -= it->job.cost;
+  queue_.erase(it);
+}
+
+uint64_t
+JobScheduler::estimate_ms(uint64_t cost) {
+  double ms = cost * ns_per_cost_ / capacity_ / 1e6;
+  return std::max((uint64_t)ms, (uint64_t)1);
+}
+
+JobScheduler::Admission
+JobScheduler::admit(Job& job, uint64_t* retry_after_ms) {
+  std::unique_lock<std::mutex> scheduler_lg(lock_);
+
+  if (Clock::now() >= job.deadline) {
+    return Admission::DeadlineMissed;
+  }
+  if (queue_.size() >= max_queued_) {
+    *retry_after_ms = estimate_ms(queued_cost_ + running_cost_);
+    return Admission::Overloaded;
+  }
+
+  uint64_t seq = next_seq_++;
+  queue_.push_back(Waiter{job, seq, Clock::now(), false});
+  queued_cost_ += job.cost;
+  if (dispatch()) {
+    cv_.notify_all();
+  }
+
+  while (!waiter(seq).admitted) {
+    if (job.deadline == Clock::time_point::max()) {
+      cv_.wait(scheduler_lg);
+    } else if (
+        cv_.wait_until(scheduler_lg, job.deadline) == std::cv_status::timeout) {
+      break;
+    }
+  }
+
+  // Either admitted or the deadline passed while waiting; in both cases
+  // don't start work that will only be late.
+  bool admitted = waiter(seq).admitted;
+  job.width = waiter(seq).job.width;
+  dequeue(seq);
+  if (!admitted || Clock::now() >= job.deadline) {
+    if (admitted) {
+      used_ -= job.width;
+    }
+    // Whoever is next now might have been waiting on us
+    if (dispatch()) {
+      cv_.notify_all();
+    }
+    return Admission::DeadlineMissed;
+  }
+
+  running_cost_ += job.cost;
+  return Admission::Run;
+}
+
+void
+JobScheduler::finish(const Job& job, Clock::duration elapsed) {
+  {
+    std::lock_guard<std::mutex> scheduler_lg(lock_);
+    used_ -= job.width;
+    running_cost_ -= job.cost;
+
+    if (job.cost > 0) {
+      double ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count() *
+          (double)job.width;
+      ns_per_cost_ = 0.8 * ns_per_cost_ + 0.2 * (ns / job.cost);
+    }
+
+    if (!dispatch()) return;
+  }
+  cv_.notify_all();
+}
+
+void
+JobScheduler::set_capacity(size_t capacity) {
+  {
+    std::lock_guard<std::mutex> scheduler_lg(lock_);
+    capacity_ = std::max(capacity, (size_t)1);
+    if (!dispatch()) return;
+  }
+  cv_.notify_all();
+}
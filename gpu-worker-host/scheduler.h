@@ -0,0 +1,93 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Job priorities are clamped to this range
+#define SCHED_MIN_PRIORITY (-16)
+#define SCHED_MAX_PRIORITY 16
+// Waiting jobs gain a priority level per this much time waited
+#define SCHED_AGING_INTERVAL std::chrono::milliseconds(100)
+
+/* Admission control and ordering for jobs running on the enclaves.
+ *
+ * Each job takes up `width` of the `capacity` enclaves while running,
+ * and jobs run concurrently as long as their widths fit. The capacity
+ * follows the enclaves actually available, see set_capacity(). At most
+ * `max_queued` jobs wait for room; further jobs are turned away
+ * immediately with a hint on when to retry. Waiting jobs run in order of
+ * priority, then estimated cost (shortest first), then arrival; the next
+ * job in that order waits for room rather than being overtaken by
+ * narrower ones. Jobs whose deadline passes while waiting are dropped
+ * instead of being run late.
+ *
+ * Priority goes up with time waited, such that every queued job runs
+ * eventually: once it has waited (SCHED_MAX_PRIORITY -
+ * SCHED_MIN_PRIORITY + 1) aging intervals, no job arriving later is
+ * ordered before it. */
+class JobScheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  enum class Admission { Run, Overloaded, DeadlineMissed };
+
+  struct Job {
+    int priority;                // Higher runs first
+    Clock::time_point deadline;  // Clock::time_point::max() for none
+    uint64_t cost;               // Estimated work, in arbitrary units
+    size_t width;                // Enclaves used, see admit()
+  };
+
+  JobScheduler(size_t max_queued, size_t capacity)
+      : max_queued_(max_queued), capacity_(std::max(capacity, (size_t)1)) {}
+
+  /* Blocks until `job` may run. On Overloaded, `retry_after_ms` is set to
+   * the estimated time until the currently admitted work drains. On Run,
+   * `job.width` is set to the enclaves granted, clamped to [1, capacity],
+   * and finish() must be called with it once the job is done. */
+  Admission admit(Job& job, uint64_t* retry_after_ms);
+  void finish(const Job& job, Clock::duration elapsed);
+
+  /* Sets how many enclaves jobs may take up at once (at least 1, such
+   * that jobs still get to fail when there are none). Running jobs are
+   * unaffected; if they now exceed the capacity, no further jobs are
+   * admitted until enough of them have finished. */
+  void set_capacity(size_t capacity);
+
+ private:
+  struct Waiter {
+    Job job;
+    uint64_t seq;
+    Clock::time_point enqueued;
+    bool admitted;
+  };
+
+  int64_t effective_priority(const Waiter& w, Clock::time_point now);
+  bool runs_before(const Waiter& a, const Waiter& b, Clock::time_point now);
+  bool dispatch();
+  Waiter& waiter(uint64_t seq);
+  void dequeue(uint64_t seq);
+  uint64_t estimate_ms(uint64_t cost);
+  size_t width(const Job& job);
+
+  size_t const max_queued_;
+  size_t capacity_;
+
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::vector<Waiter> queue_;
+  uint64_t next_seq_ = 0;
+  // Enclaves taken up by running jobs
+  size_t used_ = 0;
+  uint64_t queued_cost_ = 0;
+  uint64_t running_cost_ = 0;
+  // Moving average of the enclave time per unit of cost of finished jobs
+  double ns_per_cost_ = 1.0;
+};
+
+#endif /* _SCHEDULER_H_ */
@@ -74,6 +74,20 @@ SharedBuffer::get_unsigned_long_or_set_bad_offset() {
                        : std::nullopt;
 }
 
+std::optional<std::pair<void*, size_t>>
+SharedBuffer::get_bytes_or_set_bad_offset() {
+  auto v = get_call_args_ptr_or_set_bad_offset();
+  if (!v.has_value()) return std::nullopt;
+
+  /* Unlike C strings, the argument length is trusted here, so make sure
+   * the whole region lies within the shared buffer */
+  if (v.value().second > buffer_ + buffer_len_ - v.value().first) {
+    set_bad_offset();
+    return std::nullopt;
+  }
+  return std::pair{(void*)v.value().first, v.value().second};
+}
+
 //std::optional<Report>
 //SharedBuffer::get_report_or_set_bad_offset() {
 //  auto v = get_call_args_ptr_or_set_bad_offset();
@@ -163,3 +177,11 @@ SharedBuffer::setup_wrapped_ret_or_bad_ptr(const std::string& ret_val) {
   return;
 }
 
+void
+SharedBuffer::setup_wrapped_ret_or_bad_ptr(const void* ptr, size_t size) {
+  if (setup_wrapped_ret((void*)ptr, size)) {
+    set_bad_ptr();
+  } else {
+    set_ok();
+  }
+}
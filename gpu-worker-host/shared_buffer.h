@@ -27,11 +27,13 @@ class SharedBuffer {
 
   std::optional<char*> get_c_string_or_set_bad_offset();
   std::optional<unsigned long> get_unsigned_long_or_set_bad_offset();
+  std::optional<std::pair<void*, size_t>> get_bytes_or_set_bad_offset();
   //std::optional<Report> get_report_or_set_bad_offset();
 
   void set_ok();
   void setup_ret_or_bad_ptr(unsigned long ret_val);
   void setup_wrapped_ret_or_bad_ptr(const std::string& ret_val);
+  void setup_wrapped_ret_or_bad_ptr(const void* ptr, size_t size);
   int setup_ret(void* ptr, size_t size);
   int setup_wrapped_ret(void* ptr, size_t size);
 
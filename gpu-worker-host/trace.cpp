@@ -0,0 +1,227 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Trace {
+
+namespace {
+
+struct Event {
+  uint64_t ts_ns;
+  const char* cat;
+  const char* name;
+  uint64_t arg;
+  char phase;
+};
+
+/* Only ever locked by its own thread, except while exporting. */
+struct ThreadBuffer {
+  std::mutex lock;
+  std::vector<Event> events;
+  size_t head = 0;
+  uint64_t dropped = 0;
+  uint32_t tid;
+  std::string name;
+  bool exited = false;
+};
+
+/* Moves the buffer out of the registry at thread exit, see below. */
+struct ThreadBufferHolder {
+  std::shared_ptr<ThreadBuffer> buffer;
+  ~ThreadBufferHolder();
+};
+
+int
+initial_level() {
+  const char* env = std::getenv("GPU_WORKER_TRACE_LEVEL");
+  return env ? std::atoi(env) : TRACE_LEVEL_OFF;
+}
+
+std::atomic<int> current_level{initial_level()};
+
+/* Buffers of running threads, and of exited threads with events not yet
+ * exported, such that events of finished enclave and worker threads
+ * still show up. Exited threads' buffers are capped, as threads may come
+ * and go far more often than traces are exported. Locked before any
+ * buffer lock. */
+std::mutex registry_lock;
+std::vector<std::shared_ptr<ThreadBuffer>> registry;
+std::deque<std::shared_ptr<ThreadBuffer>> exited_registry;
+
+ThreadBufferHolder::~ThreadBufferHolder() {
+  std::lock_guard<std::mutex> registry_lg(registry_lock);
+  bool empty;
+  {
+    std::lock_guard<std::mutex> buffer_lg(buffer->lock);
+    buffer->exited = true;
+    empty = buffer->events.empty();
+  }
+
+  for (auto it = registry.begin(); it != registry.end(); it++) {
+    if (*it == buffer) {
+      registry.erase(it);
+      break;
+    }
+  }
+  if (!empty) {
+    exited_registry.push_back(buffer);
+    if (exited_registry.size() > TRACE_MAX_EXITED_THREADS) {
+      exited_registry.pop_front();
+    }
+  }
+}
+
+ThreadBuffer&
+thread_buffer() {
+  static std::atomic<uint32_t> next_tid{1};
+  thread_local ThreadBufferHolder holder{[] {
+    auto b = std::make_shared<ThreadBuffer>();
+    b->tid = next_tid++;
+    std::lock_guard<std::mutex> registry_lg(registry_lock);
+    registry.push_back(b);
+    return b;
+  }()};
+  return *holder.buffer;
+}
+
+uint64_t
+now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void
+append_json_string(std::string& out, const std::string& str) {
+  out += '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+}  // namespace
+
+void
+set_level(int level) {
+  current_level.store(level, std::memory_order_relaxed);
+}
+
+int
+level() {
+  return current_level.load(std::memory_order_relaxed);
+}
+
+void
+record(char phase, const char* cat, const char* name, uint64_t arg) {
+  ThreadBuffer& b = thread_buffer();
+  Event ev{now_ns(), cat, name, arg, phase};
+
+  std::lock_guard<std::mutex> buffer_lg(b.lock);
+  if (b.events.size() < TRACE_BUFFER_EVENTS) {
+    b.events.push_back(ev);
+  } else {
+    b.events[b.head] = ev;
+    b.head = (b.head + 1) % TRACE_BUFFER_EVENTS;
+    b.dropped++;
+  }
+}
+
+void
+set_thread_name(const std::string& name) {
+  ThreadBuffer& b = thread_buffer();
+  std::lock_guard<std::mutex> buffer_lg(b.lock);
+  b.name = name;
+}
+
+std::string
+export_chrome_json() {
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> registry_lg(registry_lock);
+    buffers = registry;
+    buffers.insert(buffers.end(), exited_registry.begin(), exited_registry.end());
+  }
+  std::vector<ThreadBuffer*> exited;
+
+  std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  char line[256];
+
+  for (auto& b : buffers) {
+    std::lock_guard<std::mutex> buffer_lg(b->lock);
+
+    if (!b->name.empty()) {
+      snprintf(
+          line, sizeof(line),
+          "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,"
+          "\"args\":{\"name\":",
+          first ? "" : ",", b->tid);
+      out += line;
+      append_json_string(out, b->name);
+      out += "}}";
+      first = false;
+    }
+
+    // Oldest event is at head once the ring has wrapped around
+    for (size_t i = 0; i < b->events.size(); i++) {
+      const Event& ev = b->events[(b->head + i) % b->events.size()];
+      snprintf(
+          line, sizeof(line),
+          "%s{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":1,"
+          "\"tid\":%u,\"ts\":%llu.%03llu%s,\"args\":{\"arg\":%llu}}",
+          first ? "" : ",", ev.phase, ev.cat, ev.name, b->tid,
+          (unsigned long long)(ev.ts_ns / 1000),
+          (unsigned long long)(ev.ts_ns % 1000),
+          ev.phase == 'i' ? ",\"s\":\"t\"" : "",
+          (unsigned long long)ev.arg);
+      out += line;
+      first = false;
+    }
+
+    if (b->dropped) {
+      fprintf(
+          stderr, "Trace: thread %u dropped %llu events\n", b->tid,
+          (unsigned long long)b->dropped);
+    }
+
+    b->events.clear();
+    b->head = 0;
+    b->dropped = 0;
+    if (b->exited) exited.push_back(b.get());
+  }
+
+  // Exited threads' buffers have nothing left to export
+  {
+    std::lock_guard<std::mutex> registry_lg(registry_lock);
+    for (ThreadBuffer* b : exited) {
+      for (auto it = exited_registry.begin(); it != exited_registry.end(); it++) {
+        if (it->get() == b) {
+          exited_registry.erase(it);
+          break;
+        }
+      }
+    }
+  }
+
+  out += "]}";
+  return out;
+}
+
+}  // namespace Trace
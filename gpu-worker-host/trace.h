@@ -0,0 +1,91 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <cstdint>
+#include <string>
+
+/* Low-overhead event tracer for the host. Events are appended as fixed
+ * size records to a per-thread ring buffer, and only formatted when
+ * exported as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+ *
+ * Category and event names must be string literals, only the pointers
+ * are recorded. */
+
+// Trace levels, each including the ones below it
+#define TRACE_LEVEL_OFF 0
+#define TRACE_LEVEL_RPC 1   // RPCs and jobs
+#define TRACE_LEVEL_OCALL 2 // ocalls and shared buffer copies
+
+// Events above this level are compiled out entirely
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_LEVEL_OCALL
+#endif
+
+// Events per thread kept before the oldest ones are overwritten
+#define TRACE_BUFFER_EVENTS (64 * 1024)
+
+// Exited threads whose events are kept until the next export, beyond
+// which the oldest ones are dropped
+#define TRACE_MAX_EXITED_THREADS 256
+
+namespace Trace {
+
+/* Runtime level, initialized from the GPU_WORKER_TRACE_LEVEL environment
+ * variable (default TRACE_LEVEL_OFF). */
+void
+set_level(int level);
+int
+level();
+
+inline bool
+enabled(int level) {
+  return level <= TRACE_MAX_LEVEL && level <= Trace::level();
+}
+
+void
+record(char phase, const char* cat, const char* name, uint64_t arg);
+
+/* Name shown for the calling thread in the exported trace. */
+void
+set_thread_name(const std::string& name);
+
+/* Formats all buffered events as Chrome trace JSON and clears the
+ * buffers, so consecutive exports don't overlap. */
+std::string
+export_chrome_json();
+
+/* Records a begin event on construction and the matching end event on
+ * destruction, if the level is enabled at construction time. */
+class Scope {
+ public:
+  Scope(int level, const char* cat, const char* name, uint64_t arg = 0)
+      : active_(enabled(level)), cat_(cat), name_(name) {
+    if (active_) record('B', cat_, name_, arg);
+  }
+  ~Scope() {
+    if (active_) record('E', cat_, name_, 0);
+  }
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+ private:
+  bool const active_;
+  const char* const cat_;
+  const char* const name_;
+};
+
+}  // namespace Trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// TRACE_SCOPE(level, cat, name[, arg])
+#define TRACE_SCOPE(...) \
+  Trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+
+#define TRACE_INSTANT(level, cat, name, arg) \
+  do { \
+    if (Trace::enabled(level)) Trace::record('i', cat, name, arg); \
+  } while (0)
+
+#endif /* _TRACE_H_ */